@@ -4,8 +4,14 @@
 #include "External/inc/tag.h"
  
 #include <unordered_map>
-#include <fstream>
 #include <sstream>
+#include <thread>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 #define __STR_INTERNAL(x) #x
@@ -22,6 +28,28 @@ using uint		= unsigned int;
 using ushort	= unsigned short;
 using uchar		= unsigned char;
 
+static_assert(sizeof(off_t) >= sizeof(uint64_t), "64-bit file offsets are required (_FILE_OFFSET_BITS=64)");
+
+// Enough for a few frames of any bitrate
+static const size_t SyncLookahead = 16 << 10;
+
+// In-memory counterpart of CMP3::CFileWindow
+class CDataSource
+{
+public:
+	CDataSource(const uchar* f_data, size_t f_size): m_data(f_data), m_size(f_size) {}
+
+	uint64_t		size		() const { return m_size; }
+	// The whole data is available at once
+	size_t			probeSize	() const { return m_size; }
+
+	const uchar*	map			(uint64_t f_offset, size_t /*f_size*/) const { return m_data + f_offset; }
+
+private:
+	const uchar*	m_data;
+	size_t			m_size;
+};
+
 
 class CMP3 final : public IMP3
 {
@@ -33,7 +61,12 @@ public:
 	}
 
 	CMP3(const std::string& f_path);
-	CMP3(const uchar* f_data, const size_t f_size): CMP3() { parse(f_data, f_size); }
+	CMP3(const std::string& f_path, const size_t f_windowSize);
+	CMP3(const uchar* f_data, const size_t f_size): CMP3()
+	{
+		CDataSource src(f_data, f_size);
+		parse(src);
+	}
 
 	std::shared_ptr<MPEG::IStream>	mpegStream		() const final override { return m_mpeg;	}
 
@@ -42,17 +75,21 @@ public:
 	std::shared_ptr<Tag::IAPE>		tagAPE			() const final override { return m_ape;		}
 	std::shared_ptr<Tag::ILyrics>	tagLyrics		() const final override { return m_lyrics;	}
 
-	unsigned						mpegStreamOffset() const final override { return m_offsets.at(DataType::MPEG		); }
-	unsigned						tagID3v1Offset	() const final override { return m_offsets.at(DataType::TagID3v1	); }
-	unsigned						tagID3v2Offset	() const final override { return m_offsets.at(DataType::TagID3v2	); }
-	unsigned						tagAPEOffset	() const final override { return m_offsets.at(DataType::TagAPE		); }
-	unsigned						tagLyricsOffset	() const final override { return m_offsets.at(DataType::TagLyrics	); }
+	uint64_t						mpegStreamOffset() const final override { return m_offsets.at(DataType::MPEG		); }
+	uint64_t						mpegStreamSize	() const final override { return m_mpegSize;							}
+	uint64_t						tagID3v1Offset	() const final override { return m_offsets.at(DataType::TagID3v1	); }
+	uint64_t						tagID3v2Offset	() const final override { return m_offsets.at(DataType::TagID3v2	); }
+	uint64_t						tagAPEOffset	() const final override { return m_offsets.at(DataType::TagAPE		); }
+	uint64_t						tagLyricsOffset	() const final override { return m_offsets.at(DataType::TagLyrics	); }
 
 	bool							hasIssues		() const final override
 	{
 		return (m_mpeg && m_mpeg->hasIssues()) || (m_id3v2 && m_id3v2->hasIssues()) || m_warnings;
 	}
 
+	std::vector<Range>				verify			(const uchar* f_data, size_t f_size) const final override;
+	std::vector<Range>				verify			() const final override;
+
 	bool							serialize		(const std::string& /*f_path*/) final override
 	{
 		ASSERT(!"Not implemented");
@@ -68,35 +105,99 @@ private:
 	{
 		unsigned operator()(const T& f_key) const { return static_cast<unsigned>(f_key); }
 	};
-	using offsets_t = std::unordered_map<DataType, unsigned, EnumHasher<DataType>>;
+	using offsets_t = std::unordered_map<DataType, uint64_t, EnumHasher<DataType>>;
+
+	// Read-only file mapping of a bounded size which slides over the file on demand
+	class CFileWindow
+	{
+	public:
+		CFileWindow(const std::string& f_path, size_t f_windowSize);
+		CFileWindow(CFileWindow&& f_other);
+		~CFileWindow();
+
+		uint64_t		size		() const { return m_size;			}
+		size_t			windowSize	() const { return m_windowSize;		}
+		// Data looked at in one go, half a window to slide less
+		size_t			probeSize	() const { return m_windowSize / 2;	}
+
+		// The range must be within the file; bigger than the window ranges are mapped as is
+		const uchar*	map			(uint64_t f_offset, size_t f_size);
+
+	private:
+		std::string		m_path;
+		int				m_fd;
+		uint64_t		m_size;
+		size_t			m_windowSize;
+
+		uchar*			m_pMapped;
+		uint64_t		m_mappedOffset;
+		size_t			m_mappedSize;
+	};
+
+	static const size_t DefaultWindowSize = 64 << 20;
+	// Smaller windows would be remapped for almost every frame
+	static const size_t MinWindowSize = 4 * SyncLookahead;
 
 private:
-	explicit CMP3(): m_warnings(0) {}
+	explicit CMP3(): m_preStream{0, 0}, m_mpegSize(0), m_postStream{0, 0}, m_size(0), m_windowSize(DefaultWindowSize), m_warnings(0) {}
 
-	void parse(const uchar* f_data, const size_t f_size);
+	bool hasStream() const { return m_offsets.count(DataType::MPEG) != 0; }
 
-	template<typename T>
-	bool tryCreateIfEmpty(DataType f_type, const uchar* f_data, size_t& ioOffset, size_t& ioSize, size_t f_tagSize, std::shared_ptr<T>& f_outTag)
+	template<typename Source>
+	void parse(Source& f_src);
+
+	// Return the offset right after the stream
+	uint64_t loadStream(CDataSource& f_src, uint64_t f_offset);
+	uint64_t loadStream(CFileWindow& f_src, uint64_t f_offset);
+	size_t findTagInLastFrame(const uchar* f_data, size_t f_size, size_t f_frameSize, uint64_t f_frameOffset);
+
+	// Garbage data is kept for in-memory parsing only: memory use of windowed parsing is bounded
+	static void keepGarbage(CDataSource& f_src, const Range& f_range, std::vector<uchar>& f_out)
+	{
+		f_out.resize(static_cast<size_t>(f_range.size));
+		memcpy(&f_out[0], f_src.map(f_range.offset, static_cast<size_t>(f_range.size)), static_cast<size_t>(f_range.size));
+	}
+	static void keepGarbage(CFileWindow& /*f_src*/, const Range& /*f_range*/, std::vector<uchar>& /*f_out*/) {}
+
+	// Every thread creates its own source
+	template<typename F>
+	std::vector<Range> verifyStream(F f_createSource, uint64_t f_begin, uint64_t f_end) const;
+	uint64_t verifyEnd() const;
+
+	template<typename T, typename Source>
+	bool tryCreateIfEmpty(DataType f_type, Source& f_src, uint64_t& ioOffset, size_t f_tagSize, std::shared_ptr<T>& f_outTag)
 	{
 		if(f_outTag)
 			return false;
 
-		auto tagSize = f_tagSize ? f_tagSize : T::getSize(f_data, static_cast<size_t>(ioOffset), static_cast<size_t>(ioSize));
+		auto unprocessed = f_src.size() - ioOffset;
+		auto tagSize = f_tagSize;
+		if(!tagSize)
+		{
+			auto size = static_cast<size_t>(std::min<uint64_t>(f_src.probeSize(), unprocessed));
+			tagSize = T::getSize(f_src.map(ioOffset, size), 0, size);
+		}
 		if(!tagSize)
 			return false;
+		if(tagSize > unprocessed)
+			throw exc_bad_data(ioOffset);
 
-		f_outTag = T::create(f_data, static_cast<size_t>(ioOffset), tagSize);
+		// The whole tag must be mapped
+		f_outTag = T::create(f_src.map(ioOffset, tagSize), 0, tagSize);
 		m_offsets[f_type] = ioOffset;
 
 		ioOffset += tagSize;
-		ioSize -= tagSize;
 
 		return true;
 	}
 
 private:
+	// Garbage around the stream
+	Range							m_preStream;
 	std::vector<uchar>				m_vPreStream;
 	std::shared_ptr<MPEG::IStream>	m_mpeg;
+	uint64_t						m_mpegSize;
+	Range							m_postStream;
 	std::vector<uchar>				m_vPostStream;
 	// Tags
 	std::shared_ptr<Tag::IID3v1>	m_id3v1;
@@ -105,6 +206,12 @@ private:
 	std::shared_ptr<Tag::ILyrics>	m_lyrics;
 
 	offsets_t						m_offsets;
+	// Parsed data size
+	uint64_t						m_size;
+
+	// Source file for file-based verification
+	std::string						m_path;
+	size_t							m_windowSize;
 
 	uint							m_warnings;
 
@@ -122,7 +229,7 @@ private:
 	class exc_bad_data : public exc_mp3
 	{
 	public:
-		exc_bad_data(size_t f_offset)
+		exc_bad_data(uint64_t f_offset)
 		{
 			std::ostringstream oss;
 			oss << "Unsupported data @ " << f_offset << " (0x" << OUT_HEX(f_offset) << ')';
@@ -131,6 +238,40 @@ private:
 	};
 
 
+	class exc_unsupported_format : public exc_mp3
+	{
+	public:
+		exc_unsupported_format(uint64_t f_offset)
+		{
+			std::ostringstream oss;
+			oss << "Free format MPEG stream @ " << f_offset << " (0x" << OUT_HEX(f_offset) << ") is not supported";
+			m_text = oss.str();
+		}
+	};
+
+
+	class exc_bad_verify_data : public exc_mp3
+	{
+	public:
+		exc_bad_verify_data(size_t f_size, uint64_t f_end)
+		{
+			std::ostringstream oss;
+			oss << "Data of " << f_size << " bytes doesn't hold the MPEG stream ending @ " << f_end << " (0x" << OUT_HEX(f_end) << ')';
+			m_text = oss.str();
+		}
+	};
+
+
+	class exc_no_file : public exc_mp3
+	{
+	public:
+		exc_no_file()
+		{
+			m_text = "The object isn't created from a file";
+		}
+	};
+
+
 	class exc_bad_file : public exc_mp3
 	{
 	public:
@@ -143,13 +284,13 @@ private:
 	};
 
 
-	class exc_bad_file_read : public exc_mp3 //exc_bad_file
+	class exc_bad_file_map : public exc_mp3 //exc_bad_file
 	{
 	public:
-		exc_bad_file_read(const std::string& f_path, size_t f_actual, size_t f_expected)
+		exc_bad_file_map(const std::string& f_path, uint64_t f_offset, size_t f_size)
 		{
 			std::ostringstream oss;
-			oss << "Failed to read file \"" << f_path << "\" (" << f_actual << " of " << f_expected << " bytes read)";
+			oss << "Failed to map file \"" << f_path << "\" (" << f_size << " bytes @ " << f_offset << ')';
 			m_text = oss.str();
 		}
 	};
@@ -159,26 +300,355 @@ private:
 CMP3::CMP3(const std::string& f_path):
 	CMP3()
 {
-	std::ifstream file(f_path.c_str(), std::ifstream::in | std::ifstream::binary);
-	if(!file.is_open())
+	m_path = f_path;
+
+	// The MPEG library needs the whole stream at once, so map the entire file
+	CFileWindow file(f_path, m_windowSize);
+	auto size = file.size();
+	if(size != static_cast<size_t>(size))
+		throw exc_bad_file_map(f_path, 0, static_cast<size_t>(size));
+
+	CDataSource src(file.map(0, static_cast<size_t>(size)), static_cast<size_t>(size));
+	parse(src);
+}
+
+CMP3::CMP3(const std::string& f_path, const size_t f_windowSize):
+	CMP3()
+{
+	m_path = f_path;
+	m_windowSize = f_windowSize;
+
+	CFileWindow file(f_path, f_windowSize);
+	parse(file);
+}
+
+// ============================================================================
+CMP3::CFileWindow::CFileWindow(const std::string& f_path, size_t f_windowSize):
+	m_path(f_path),
+	m_fd(-1),
+	m_size(0),
+	m_windowSize(std::max(f_windowSize, MinWindowSize)),
+	m_pMapped(nullptr),
+	m_mappedOffset(0),
+	m_mappedSize(0)
+{
+	m_fd = open(f_path.c_str(), O_RDONLY);
+	if(m_fd < 0)
 		throw exc_bad_file(f_path);
 
-	std::filebuf* pFileBuf = file.rdbuf();
+	struct stat st;
+	if(fstat(m_fd, &st))
+	{
+		close(m_fd);
+		throw exc_bad_file(f_path);
+	}
+	m_size = static_cast<uint64_t>(st.st_size);
+}
+
+CMP3::CFileWindow::CFileWindow(CFileWindow&& f_other):
+	m_path(std::move(f_other.m_path)),
+	m_fd(f_other.m_fd),
+	m_size(f_other.m_size),
+	m_windowSize(f_other.m_windowSize),
+	m_pMapped(f_other.m_pMapped),
+	m_mappedOffset(f_other.m_mappedOffset),
+	m_mappedSize(f_other.m_mappedSize)
+{
+	f_other.m_fd = -1;
+	f_other.m_pMapped = nullptr;
+	f_other.m_mappedSize = 0;
+}
+
+CMP3::CFileWindow::~CFileWindow()
+{
+	if(m_pMapped)
+		munmap(m_pMapped, m_mappedSize);
+	if(m_fd >= 0)
+		close(m_fd);
+}
+
+const uchar* CMP3::CFileWindow::map(uint64_t f_offset, size_t f_size)
+{
+	ASSERT(f_offset <= m_size && f_size <= m_size - f_offset);
+
+	if(m_pMapped && f_offset >= m_mappedOffset && f_offset + f_size <= m_mappedOffset + m_mappedSize)
+		return m_pMapped + (f_offset - m_mappedOffset);
+
+	if(m_pMapped)
+	{
+		munmap(m_pMapped, m_mappedSize);
+		m_pMapped = nullptr;
+		m_mappedSize = 0;
+	}
+
+	// Nothing to map for an empty range
+	if(!f_size)
+		return nullptr;
+
+	// The mapping must start at a page boundary
+	static const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	auto offset = f_offset - f_offset % pageSize;
+	auto size = std::max<uint64_t>(std::max(m_windowSize, f_size) + (f_offset - offset), pageSize);
+	size = std::min(size, m_size - offset);
+
+	auto pMapped = mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE, m_fd, static_cast<off_t>(offset));
+	if(pMapped == MAP_FAILED)
+		throw exc_bad_file_map(m_path, f_offset, f_size);
+	madvise(pMapped, static_cast<size_t>(size), MADV_SEQUENTIAL);
+
+	m_pMapped = static_cast<uchar*>(pMapped);
+	m_mappedOffset = offset;
+	m_mappedSize = static_cast<size_t>(size);
+
+	return m_pMapped + (f_offset - m_mappedOffset);
+}
+
+// ============================================================================
+// MPEG frames
+struct FrameHeader
+{
+	uint	size;
+	uint	key;		// Fields that must not change along the stream
+	uint	crcBits;	// Bits protected by CRC after the check word (Layer II: bit allocation only)
+	bool	isProtected;
+
+	// Layer II bit allocation layout
+	uint	layer;
+	uint	channels;
+	uint	bound;		// First subband with a single allocation for all channels
+	uint	sblimit;
+	uint	allocTable;
+};
+
+// Bits of a Layer II subband allocation (ISO/IEC 11172-3 B.2a-d, ISO/IEC 13818-3 B.1)
+static uint layer2AllocBits(uint f_table, uint f_subband)
+{
+	switch(f_table)
+	{
+		case 0:
+		case 1:
+			return (f_subband < 11) ? 4 : ((f_subband < 23) ? 3 : 2);
+		case 2:
+		case 3:
+			return (f_subband < 2) ? 4 : 3;
+		default:
+			return (f_subband < 4) ? 4 : ((f_subband < 11) ? 3 : 2);
+	}
+}
+
+static bool parseFrameHeader(const uchar* f_data, size_t f_size, FrameHeader& f_out)
+{
+	if(f_size < 4 || f_data[0] != 0xFF || (f_data[1] & 0xE0) != 0xE0)
+		return false;
+
+	auto version	= static_cast<MPEG::Version>((f_data[1] >> 3) & 0x3);
+	uint layer		= 4 - ((f_data[1] >> 1) & 0x3);
+	uint brIndex	= f_data[2] >> 4;
+	uint srIndex	= (f_data[2] >> 2) & 0x3;
+	uint padding	= (f_data[2] >> 1) & 0x1;
+	auto mode		= static_cast<MPEG::ChannelMode>(f_data[3] >> 6);
+	uint modeExt	= (f_data[3] >> 4) & 0x3;
+	auto emphasis	= static_cast<MPEG::Emphasis>(f_data[3] & 0x3);
+
+	// Free format bitrate is not supported
+	if(version == MPEG::Version::vReserved || layer == 4 || !brIndex || brIndex == 0xF || srIndex == 0x3 ||
+	   emphasis == MPEG::Emphasis::Reserved)
+		return false;
+
+	static const ushort bitrates[2][3][14] =
+	{
+		{
+			{ 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+			{ 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },
+			{ 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 }
+		},
+		{
+			{ 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256 },
+			{  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 },
+			{  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 }
+		}
+	};
+	static const uint rates[3] = { 44100, 48000, 32000 };
+
+	bool v1 = (version == MPEG::Version::v1);
+	uint bitrate = bitrates[v1 ? 0 : 1][layer - 1][brIndex - 1] * 1000;
+	uint rate = rates[srIndex] >> (v1 ? 0 : (version == MPEG::Version::v2 ? 1 : 2));
+	bool mono = (mode == MPEG::ChannelMode::Mono);
+	uint channels = mono ? 1 : 2;
+	uint bound = (mode == MPEG::ChannelMode::JointStereo) ? 4 * (modeExt + 1) : 32;
+
+	f_out.layer = layer;
+	f_out.channels = channels;
+
+	switch(layer)
+	{
+		case 1:
+			f_out.size = (12 * bitrate / rate + padding) * 4;
+			// Allocation bits: 4 per subband and channel, intensity subbands are shared
+			f_out.crcBits = 4 * (channels * bound + (32 - bound));
+			break;
+		case 2:
+		{
+			f_out.size = 144 * bitrate / rate + padding;
+
+			// The allocation table depends on the bitrate per channel
+			static const uint sblimits[5] = { 27, 30, 8, 12, 30 };
+			uint chBitrate = bitrate / 1000 / channels;
+			if(!v1)
+				f_out.allocTable = 4;
+			else if((rate == 48000 && chBitrate >= 56) || (chBitrate >= 56 && chBitrate <= 80))
+				f_out.allocTable = 0;
+			else if(rate != 48000 && chBitrate >= 96)
+				f_out.allocTable = 1;
+			else if(rate != 32000 && chBitrate <= 48)
+				f_out.allocTable = 2;
+			else
+				f_out.allocTable = 3;
+			f_out.sblimit = sblimits[f_out.allocTable];
+			f_out.bound = std::min(bound, f_out.sblimit);
+
+			// Scale factor selection info depends on the allocation, see checkFrameCRC
+			f_out.crcBits = 0;
+			for(uint sb = 0; sb < f_out.sblimit; ++sb)
+				f_out.crcBits += layer2AllocBits(f_out.allocTable, sb) * ((sb < f_out.bound) ? channels : 1);
+			break;
+		}
+		default:
+			f_out.size = (v1 ? 144 : 72) * bitrate / rate + padding;
+			// Side information
+			f_out.crcBits = 8 * (v1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+			break;
+	}
+
+	f_out.key = static_cast<uint>(version) | (layer << 2) | (srIndex << 4) | (static_cast<uint>(mono) << 6);
+	f_out.isProtected = !(f_data[1] & 0x1);
+
+	return f_out.size >= (f_out.isProtected ? 6 + (f_out.crcBits + 7) / 8 : 4);
+}
+
+static bool isFreeFormat(const uchar* f_data, size_t f_size)
+{
+	return f_size >= 4 && f_data[0] == 0xFF && (f_data[1] & 0xE0) == 0xE0 && !(f_data[2] >> 4);
+}
+
+// A valid frame consistent with the stream which fits the data
+static bool readFrameHeader(const uchar* f_data, size_t f_size, uint f_key, FrameHeader& f_out)
+{
+	return parseFrameHeader(f_data, f_size, f_out) && f_out.key == f_key && f_out.size <= f_size;
+}
+
+// CRC-16 (polynomial 0x8005) over the given number of bits, MSB first
+static ushort crc16(ushort f_crc, const uchar* f_data, size_t f_bits)
+{
+	struct Table
+	{
+		ushort v[256];
+		Table()
+		{
+			for(uint i = 0; i < 256; ++i)
+			{
+				uint crc = i << 8;
+				for(uint b = 0; b < 8; ++b)
+					crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : (crc << 1);
+				v[i] = static_cast<ushort>(crc);
+			}
+		}
+	};
+	static const Table table;
+
+	for(; f_bits >= 8; f_bits -= 8, ++f_data)
+		f_crc = static_cast<ushort>((f_crc << 8) ^ table.v[(f_crc >> 8) ^ *f_data]);
+
+	for(uint i = 0; i < f_bits; ++i)
+	{
+		bool bit = (*f_data >> (7 - i)) & 0x1;
+		bool msb = f_crc & 0x8000;
+		f_crc = static_cast<ushort>(f_crc << 1);
+		if(bit != msb)
+			f_crc ^= 0x8005;
+	}
+
+	return f_crc;
+}
+
+static uint readBits(const uchar* f_data, size_t& ioBit, uint f_count)
+{
+	uint value = 0;
+	for(; f_count; --f_count, ++ioBit)
+		value = (value << 1) | ((f_data[ioBit >> 3] >> (7 - (ioBit & 7))) & 0x1);
+	return value;
+}
+
+// The frame must be complete
+static bool checkFrameCRC(const uchar* f_data, const FrameHeader& f_header)
+{
+	size_t bits = f_header.crcBits;
+
+	// Layer II also protects 2 bits of scale factor selection info per allocated subband and channel
+	if(f_header.layer == 2)
+	{
+		size_t bit = 0;
+		for(uint sb = 0; sb < f_header.sblimit; ++sb)
+		{
+			auto allocBits = layer2AllocBits(f_header.allocTable, sb);
+			if(sb < f_header.bound)
+			{
+				for(uint ch = 0; ch < f_header.channels; ++ch)
+				{
+					if(readBits(f_data + 6, bit, allocBits))
+						bits += 2;
+				}
+			}
+			else if(readBits(f_data + 6, bit, allocBits))
+				bits += 2 * f_header.channels;
+		}
+
+		if(6 + (bits + 7) / 8 > f_header.size)
+			return false;
+	}
 
-	std::streampos size = pFileBuf->pubseekoff(0, file.end, file.in);
-	pFileBuf->pubseekpos(0, file.in);
+	// The CRC covers the last two header bytes and the protected bits following the check word
+	auto crc = crc16(0xFFFF, f_data + 2, 16);
+	crc = crc16(crc, f_data + 6, bits);
+	return crc == ((f_data[4] << 8) | f_data[5]);
+}
 
-	std::vector<uchar> data(size);
-	auto read = pFileBuf->sgetn(reinterpret_cast<char*>(&data[0]), size);
-	if(read != size)
-		throw exc_bad_file_read(f_path, read, size);
+// Resynchronization point: a frame followed by (f_depth - 1) frames or the end of data
+template<typename Source>
+static bool isSyncPoint(Source& f_src, uint64_t f_offset, uint64_t f_end, uint f_key, uint f_depth)
+{
+	auto size = static_cast<size_t>(std::min<uint64_t>(SyncLookahead, f_end - f_offset));
+	auto pData = f_src.map(f_offset, size);
 
-	parse(&data[0], size);
+	for(size_t offset = 0; f_depth && offset < size; --f_depth)
+	{
+		FrameHeader header;
+		if(!readFrameHeader(pData + offset, size - offset, f_key, header))
+		{
+			// A frame truncated by the end of data still continues the chain
+			return parseFrameHeader(pData + offset, size - offset, header) && header.key == f_key &&
+				   f_offset + size == f_end;
+		}
+		offset += header.size;
+	}
+	return true;
 }
 
+template<typename Source>
+static uint64_t findSyncPoint(Source& f_src, uint64_t f_begin, uint64_t f_end, uint f_key, uint f_depth)
+{
+	for(auto offset = f_begin; offset < f_end; ++offset)
+	{
+		if(isSyncPoint(f_src, offset, f_end, f_key, f_depth))
+			return offset;
+	}
+	return f_end;
+}
 
+// ============================================================================
+// Parsing
 template<typename T>
-static uint findTag(const uchar* f_data, size_t f_size, size_t f_scanSize)
+static size_t findTag(const uchar* f_data, size_t f_size, size_t f_scanSize)
 {
 	for(size_t rfo = 0, sz = f_size, n = f_scanSize; sz && n; ++rfo, --sz, --n)
 	{
@@ -193,166 +663,253 @@ static uint findTag(const uchar* f_data, size_t f_size, size_t f_scanSize)
 	return f_scanSize;
 }
 
-void CMP3::parse(const uchar* f_data, const size_t f_size)
+size_t CMP3::findTagInLastFrame(const uchar* f_data, size_t f_size, size_t f_frameSize, uint64_t f_frameOffset)
 {
-	size_t preCalculatedTagAPEsize = 0;
+	// APE
+	auto o = findTag<Tag::IAPE>(f_data, f_size, f_frameSize);
+	if(o < f_frameSize)
+	{
+		WARNING("APE tag in the last MPEG frame @ " << (f_frameOffset + o) << " (0x" << OUT_HEX(f_frameOffset + o) << ") - keep the tag, discard the frame");
+		return o;
+	}
+
+	// Lyrics
+	o = findTag<Tag::ILyrics>(f_data, f_size, f_frameSize);
+	if(o < f_frameSize)
+		WARNING("Lyrics tag in the last MPEG frame @ " << (f_frameOffset + o) << " (0x" << OUT_HEX(f_frameOffset + o) << ") - keep the tag, discard the frame");
+	return o;
+}
 
-	for(size_t offset = 0, unprocessed = f_size; offset < f_size;)
+uint64_t CMP3::loadStream(CDataSource& f_src, uint64_t f_offset)
+{
+	auto unprocessed = static_cast<size_t>(f_src.size() - f_offset);
+	auto pData = f_src.map(f_offset, unprocessed);
+
+	m_mpeg = MPEG::IStream::create(pData, unprocessed);
+	m_offsets[DataType::MPEG] = f_offset;
+
+	// Check the last frame for unexpected data
+	ASSERT(m_mpeg->getFrameCount());
+	auto uLast = m_mpeg->getFrameCount() - 1;
+	auto uRelLastOffset = m_mpeg->getFrameOffset(uLast);
+	auto uLastSize = m_mpeg->getFrameSize(uLast);
+
+	auto o = findTagInLastFrame(pData + uRelLastOffset, unprocessed - uRelLastOffset, uLastSize, f_offset + uRelLastOffset);
+	if(o < uLastSize)
 	{
-		ASSERT(unprocessed <= f_size);
+		auto removed = m_mpeg->truncate(1);
+		ASSERT(removed == 1);
+		ASSERT(uRelLastOffset == m_mpeg->getSize());
+	}
 
-		// MPEG stream
-		if(!m_mpeg && MPEG::IStream::verifyFrameSequence(f_data + offset, unprocessed))
+	m_mpegSize = m_mpeg->getSize();
+	return f_offset + uRelLastOffset + o;
+}
+
+// The MPEG library needs the whole stream at once: follow the frame chain instead of loading
+// the stream. A broken chain is resynchronized unless trailing data starts there.
+uint64_t CMP3::loadStream(CFileWindow& f_src, uint64_t f_offset)
+{
+	const auto size = f_src.size();
+
+	auto unprocessed = static_cast<size_t>(std::min<uint64_t>(SyncLookahead, size - f_offset));
+	auto pData = f_src.map(f_offset, unprocessed);
+	if(isFreeFormat(pData, unprocessed))
+		throw exc_unsupported_format(f_offset);
+
+	FrameHeader first;
+	if(!parseFrameHeader(pData, unprocessed, first))
+		throw exc_bad_data(f_offset);
+	m_offsets[DataType::MPEG] = f_offset;
+
+	uint64_t offset = f_offset;
+	uint64_t lastOffset = offset;
+	size_t lastSize = 0;
+	while(offset < size)
+	{
+		unprocessed = static_cast<size_t>(std::min<uint64_t>(SyncLookahead, size - offset));
+		FrameHeader header;
+		if(readFrameHeader(f_src.map(offset, unprocessed), unprocessed, first.key, header))
 		{
-			auto pData = f_data + offset;
+			lastOffset = offset;
+			lastSize = header.size;
+			offset += header.size;
+			continue;
+		}
 
-			m_mpeg = MPEG::IStream::create(pData, unprocessed);
-			m_offsets[DataType::MPEG] = offset;
+		auto next = offset;
+		for(; next < size; ++next)
+		{
+			unprocessed = static_cast<size_t>(std::min<uint64_t>(f_src.probeSize(), size - next));
+			pData = f_src.map(next, unprocessed);
+			if( Tag::IAPE::getSize(pData, 0, unprocessed) || Tag::IID3v1::getSize(pData, 0, unprocessed) ||
+				Tag::ILyrics::getSize(pData, 0, unprocessed) )
+			{
+				next = size;
+				break;
+			}
+			if(next != offset && isSyncPoint(f_src, next, size, first.key, 3))
+				break;
+		}
+		if(next == size)
+			break;
 
-			// Check the last frame for unexpected data
-			ASSERT(m_mpeg->getFrameCount());
-			auto uLast = m_mpeg->getFrameCount() - 1;
-			auto uRelLastOffset = m_mpeg->getFrameOffset(uLast);
+		auto sz = next - offset;
+		WARNING(sz << " (0x" << OUT_HEX(sz) << ") bytes of damaged MPEG data @ " << offset << " (0x" << OUT_HEX(offset) << ')');
+		offset = next;
+	}
 
-			uint o;
-			do
-			{
-				auto uLastOffset = offset + uRelLastOffset;
-				auto uLastSize = m_mpeg->getFrameSize(uLast);
-				auto size = unprocessed - uRelLastOffset;
+	// Check the last frame for unexpected data
+	unprocessed = static_cast<size_t>(std::min<uint64_t>(f_src.probeSize(), size - lastOffset));
+	auto o = findTagInLastFrame(f_src.map(lastOffset, unprocessed), unprocessed, lastSize, lastOffset);
+	if(o < lastSize)
+	{
+		m_mpegSize = lastOffset - f_offset;
+		return lastOffset + o;
+	}
 
-				// APE
-				o = findTag<Tag::IAPE>(pData + uRelLastOffset, size, uLastSize);
-				if(o < uLastSize)
-				{
-					WARNING("APE tag in the last MPEG frame @ " << (uLastOffset + o) << " (0x" << OUT_HEX(uLastOffset + o) << ") - keep the tag, discard the frame");
-					auto removed = m_mpeg->truncate(1);
-					ASSERT(removed == 1);
-					ASSERT(uRelLastOffset == m_mpeg->getSize());
-					break;
-				}
+	// The MPEG library isn't called to report an incomplete frame
+	if(offset < size)
+	{
+		unprocessed = static_cast<size_t>(size - offset);
+		FrameHeader header;
+		if(parseFrameHeader(f_src.map(offset, std::min(SyncLookahead, unprocessed)), std::min(SyncLookahead, unprocessed), header) &&
+		   header.key == first.key && header.size > unprocessed)
+			WARNING("incomplete MPEG frame @ " << offset << " (0x" << OUT_HEX(offset) << "): " << unprocessed << " of " << header.size << " bytes");
+	}
 
-				// Lyrics
-				o = findTag<Tag::ILyrics>(pData + uRelLastOffset, size, uLastSize);
-				if(o < uLastSize)
-				{
-					WARNING("Lyrics tag in the last MPEG frame @ " << (uLastOffset + o) << " (0x" << OUT_HEX(uLastOffset + o) << ") - keep the tag, discard the frame");
-					auto removed = m_mpeg->truncate(1);
-					ASSERT(removed == 1);
-					ASSERT(uRelLastOffset == m_mpeg->getSize());
-					break;
-				}
-			}
-			while(0);
+	m_mpegSize = offset - f_offset;
+	return offset;
+}
 
-			o += uRelLastOffset;
-			offset += o;
-			unprocessed -= o;
+template<typename Source>
+void CMP3::parse(Source& f_src)
+{
+	const auto size = f_src.size();
+	m_size = size;
+	auto probe = [&f_src, size](uint64_t f_offset)
+	{
+		return static_cast<size_t>(std::min<uint64_t>(f_src.probeSize(), size - f_offset));
+	};
+
+	size_t preCalculatedTagAPEsize = 0;
+
+	for(uint64_t offset = 0; offset < size;)
+	{
+		auto unprocessed = probe(offset);
+		auto pData = f_src.map(offset, unprocessed);
+
+		// MPEG stream
+		if(!hasStream() && MPEG::IStream::verifyFrameSequence(pData, unprocessed))
+		{
+			offset = loadStream(f_src, offset);
 			continue;
 		}
 
 		// Tags
-		if( tryCreateIfEmpty(DataType::TagID3v1, f_data, offset, unprocessed, 0, m_id3v1) )
+		if( tryCreateIfEmpty(DataType::TagID3v1, f_src, offset, 0, m_id3v1) )
 		{
 			auto o = offset - m_id3v1->getSize();
-			if(unprocessed)
+			if(offset < size)
 				WARNING("ID3v1 tag @ invalid offset " << o << " (0x" << OUT_HEX(o) << ')');
 			continue;
 		}
-		if( tryCreateIfEmpty(DataType::TagID3v2, f_data, offset, unprocessed, 0, m_id3v2) )
+		if( tryCreateIfEmpty(DataType::TagID3v2, f_src, offset, 0, m_id3v2) )
 			continue;
-		if( tryCreateIfEmpty(DataType::TagAPE, f_data, offset, unprocessed, preCalculatedTagAPEsize, m_ape) )
+		if( tryCreateIfEmpty(DataType::TagAPE, f_src, offset, preCalculatedTagAPEsize, m_ape) )
 		{
 			preCalculatedTagAPEsize = 0;
 			continue;
 		}
-		if( tryCreateIfEmpty(DataType::TagLyrics, f_data, offset, unprocessed, 0, m_lyrics) )
+		if( tryCreateIfEmpty(DataType::TagLyrics, f_src, offset, 0, m_lyrics) )
 			continue;
 
 		// Check for padding nulls
-		if(f_data[offset] == 0)
+		if(pData[0] == 0)
 		{
 			++offset;
-			--unprocessed;
 			continue;
 		}
 
-		if(m_mpeg)
+		if(hasStream())
 		{
 			// Check for an incomplete frame
-			if( MPEG::IStream::isIncompleteFrame(f_data + offset, unprocessed) )
+			if( MPEG::IStream::isIncompleteFrame(pData, unprocessed) )
 			{
 				// The corresponding warning is emited by the MPEG library
-				offset += unprocessed;
-				unprocessed -= unprocessed;
+				offset = size;
 				continue;
 			}
 
 			// Post MPEG stream garbage?
-			ASSERT(m_vPostStream.empty());
+			ASSERT(!m_postStream.size);
 
 			auto oPrev = offset;
-			auto uPrev = unprocessed;
-			for(; unprocessed; ++offset, --unprocessed)
+			for(; offset < size; ++offset)
 			{
-				if(auto tagSize = Tag::IAPE::getSize(f_data, offset, unprocessed))
+				unprocessed = probe(offset);
+				pData = f_src.map(offset, unprocessed);
+
+				if(auto tagSize = Tag::IAPE::getSize(pData, 0, unprocessed))
 				{
 					auto next = offset + tagSize;
 					// Handle footer-only APE tag
 					if(next < offset)
 					{
-						preCalculatedTagAPEsize = Tag::IAPE::getSize(f_data, next, tagSize);
+						auto footerSize = probe(next);
+						preCalculatedTagAPEsize = Tag::IAPE::getSize(f_src.map(next, footerSize), 0, footerSize);
 						offset = next;
-						unprocessed = uPrev - (offset - oPrev);
 					}
 					break;
 				}
 
-				if( Tag::IID3v1::getSize(f_data, offset, unprocessed) )
+				if( Tag::IID3v1::getSize(pData, 0, unprocessed) )
 					break;
-				if( Tag::ILyrics::getSize(f_data, offset, unprocessed) )
+				if( Tag::ILyrics::getSize(pData, 0, unprocessed) )
 					break;
 
-				ASSERT(Tag::IID3v2::getSize(f_data, offset, unprocessed) == 0);
+				ASSERT(Tag::IID3v2::getSize(pData, 0, unprocessed) == 0);
 			}
 
 			// Might be zero if APE footer-only tag is found
-			if(auto sz = uPrev - unprocessed)
+			if(auto sz = static_cast<size_t>(offset - oPrev))
 			{
 				WARNING(sz << " (0x" << OUT_HEX(sz) << ") bytes of garbage after the MPEG stream @ " <<
 						oPrev << " (0x" << OUT_HEX(oPrev) << ')');
 
-				m_vPostStream.resize(sz);
-				memcpy(&m_vPostStream[0], f_data + oPrev, sz);
+				m_postStream = { oPrev, sz };
+				keepGarbage(f_src, m_postStream, m_vPostStream);
 			}
 			continue;
 		}
 		else
 		{
 			// Pre MPEG stream garbage?
-			ASSERT(m_vPreStream.empty());
+			ASSERT(!m_preStream.size);
 
 			auto oPrev = offset;
-			auto uPrev = unprocessed;
-			for(; unprocessed; ++offset, --unprocessed)
+			for(; offset < size; ++offset)
 			{
-				if(MPEG::IStream::verifyFrameSequence(f_data + offset, unprocessed))
+				unprocessed = probe(offset);
+				pData = f_src.map(offset, unprocessed);
+
+				if(MPEG::IStream::verifyFrameSequence(pData, unprocessed))
 					break;
 
-				ASSERT(Tag::IID3v1	::getSize(f_data, offset, unprocessed) == 0);
-				ASSERT(Tag::IID3v2	::getSize(f_data, offset, unprocessed) == 0);
-				ASSERT(Tag::IAPE	::getSize(f_data, offset, unprocessed) == 0);
-				ASSERT(Tag::ILyrics	::getSize(f_data, offset, unprocessed) == 0);
+				ASSERT(Tag::IID3v1	::getSize(pData, 0, unprocessed) == 0);
+				ASSERT(Tag::IID3v2	::getSize(pData, 0, unprocessed) == 0);
+				ASSERT(Tag::IAPE	::getSize(pData, 0, unprocessed) == 0);
+				ASSERT(Tag::ILyrics	::getSize(pData, 0, unprocessed) == 0);
 			}
 
-			if(unprocessed)
+			if(offset < size)
 			{
-				auto sz = uPrev - unprocessed;
+				auto sz = static_cast<size_t>(offset - oPrev);
 				WARNING(sz << " (0x" << OUT_HEX(sz) << ") bytes of garbage before the MPEG stream @ " <<
 						oPrev << " (0x" << OUT_HEX(oPrev) << ')');
 
-				m_vPreStream.resize(sz);
-				memcpy(&m_vPreStream[0], f_data + offset, sz);
+				m_preStream = { oPrev, sz };
+				keepGarbage(f_src, m_preStream, m_vPreStream);
 				continue;
 			}
 		}
@@ -360,10 +917,196 @@ void CMP3::parse(const uchar* f_data, const size_t f_size)
 		throw exc_bad_data(offset);
 	}
 
-	if(!m_mpeg)
+	if(!hasStream())
 		WARNING("no MPEG stream");
 }
 
+// ============================================================================
+// Verification
+static void addRange(std::vector<IMP3::Range>& f_ranges, uint64_t f_offset, uint64_t f_size)
+{
+	if(!f_ranges.empty() && f_ranges.back().offset + f_ranges.back().size == f_offset)
+		f_ranges.back().size += f_size;
+	else
+		f_ranges.push_back({ f_offset, f_size });
+}
+
+// The chunk [f_begin, f_end) must be bounded by frame boundaries
+template<typename Source>
+static void verifyChunk(Source& f_src, uint64_t f_begin, uint64_t f_end, uint f_key, std::vector<IMP3::Range>& f_outRanges)
+{
+	for(auto offset = f_begin; offset < f_end;)
+	{
+		auto size = static_cast<size_t>(std::min<uint64_t>(SyncLookahead, f_end - offset));
+		auto pData = f_src.map(offset, size);
+
+		FrameHeader header;
+		if(readFrameHeader(pData, size, f_key, header))
+		{
+			if(header.isProtected && !checkFrameCRC(pData, header))
+				addRange(f_outRanges, offset, header.size);
+			offset += header.size;
+			continue;
+		}
+
+		auto next = findSyncPoint(f_src, offset + 1, f_end, f_key, 2);
+		addRange(f_outRanges, offset, next - offset);
+		offset = next;
+	}
+}
+
+template<typename F>
+static void runParallel(uint f_count, F f_func)
+{
+	std::vector<std::exception_ptr> errors(f_count);
+
+	std::vector<std::thread> threads;
+	threads.reserve(f_count);
+	try
+	{
+		for(uint i = 0; i < f_count; ++i)
+		{
+			threads.emplace_back([&f_func, &errors, i]
+			{
+				try { f_func(i); }
+				catch(...) { errors[i] = std::current_exception(); }
+			});
+		}
+	}
+	catch(...)
+	{
+		// Joinable threads must not be destroyed
+		for(auto& t : threads)
+			t.join();
+		throw;
+	}
+	for(auto& t : threads)
+		t.join();
+
+	for(auto& e : errors)
+	{
+		if(e)
+			std::rethrow_exception(e);
+	}
+}
+
+template<typename F>
+std::vector<IMP3::Range> CMP3::verifyStream(F f_createSource, uint64_t f_begin, uint64_t f_end) const
+{
+	std::vector<Range> ranges;
+
+	FrameHeader first;
+	auto start = f_begin;
+	{
+		auto src = f_createSource();
+
+		// Padding nulls before the trailing data aren't damage
+		while(f_end > f_begin)
+		{
+			auto size = static_cast<size_t>(std::min<uint64_t>(SyncLookahead, f_end - f_begin));
+			auto pData = src.map(f_end - size, size);
+			size_t nulls = 0;
+			while(nulls < size && !pData[size - 1 - nulls])
+				++nulls;
+
+			f_end -= nulls;
+			if(nulls < size)
+				break;
+		}
+		if(f_end == f_begin)
+			return ranges;
+
+		auto size = static_cast<size_t>(std::min<uint64_t>(SyncLookahead, f_end - f_begin));
+		auto pData = src.map(f_begin, size);
+		if(isFreeFormat(pData, size))
+			throw exc_unsupported_format(f_begin);
+
+		// A damaged first frame: take the stream properties from the first sync point
+		if(!parseFrameHeader(pData, size, first))
+		{
+			for(++start; start < f_end; ++start)
+			{
+				size = static_cast<size_t>(std::min<uint64_t>(SyncLookahead, f_end - start));
+				if(parseFrameHeader(src.map(start, size), size, first) && isSyncPoint(src, start, f_end, first.key, 3))
+					break;
+			}
+
+			addRange(ranges, f_begin, start - f_begin);
+			if(start == f_end)
+				return ranges;
+		}
+	}
+
+	// Small chunks aren't worth a thread
+	const uint64_t minChunkSize = 1 << 20;
+	uint chunks = std::max(std::thread::hardware_concurrency(), 1u);
+	chunks = static_cast<uint>(std::max<uint64_t>(std::min<uint64_t>(chunks, (f_end - start) / minChunkSize), 1));
+	const uint64_t chunkSize = (f_end - start) / chunks;
+
+	// Align chunk boundaries to frames. Since every boundary is the first sync point after
+	// the nominal start the boundaries are ordered and the chunks are tiled with frames.
+	std::vector<uint64_t> bounds(chunks + 1, f_end);
+	bounds[0] = start;
+	runParallel(chunks - 1, [&](uint i)
+	{
+		auto src = f_createSource();
+		bounds[i + 1] = findSyncPoint(src, start + (i + 1) * chunkSize, f_end, first.key, 3);
+	});
+
+	std::vector<std::vector<Range>> chunkRanges(chunks);
+	runParallel(chunks, [&](uint i)
+	{
+		auto src = f_createSource();
+		verifyChunk(src, bounds[i], bounds[i + 1], first.key, chunkRanges[i]);
+	});
+
+	for(const auto& cr : chunkRanges)
+	{
+		for(const auto& r : cr)
+			addRange(ranges, r.offset, r.size);
+	}
+
+	return ranges;
+}
+
+// The MPEG library may end the stream at a broken frame: check everything up to the trailing
+// tags or the end of data instead, so a truncated last frame is reported as well
+uint64_t CMP3::verifyEnd() const
+{
+	auto begin = m_offsets.at(DataType::MPEG);
+	auto end = m_size;
+	for(const auto& o : m_offsets)
+	{
+		if(o.second > begin)
+			end = std::min(end, o.second);
+	}
+	return end;
+}
+
+std::vector<IMP3::Range> CMP3::verify(const uchar* f_data, const size_t f_size) const
+{
+	if(!hasStream())
+		return std::vector<Range>();
+
+	auto begin = m_offsets.at(DataType::MPEG);
+	auto end = verifyEnd();
+	if(end > f_size)
+		throw exc_bad_verify_data(f_size, end);
+
+	return verifyStream([f_data, f_size]{ return CDataSource(f_data, f_size); }, begin, end);
+}
+
+std::vector<IMP3::Range> CMP3::verify() const
+{
+	if(m_path.empty())
+		throw exc_no_file();
+	if(!hasStream())
+		return std::vector<Range>();
+
+	auto begin = m_offsets.at(DataType::MPEG);
+	return verifyStream([this]{ return CFileWindow(m_path, m_windowSize); }, begin, verifyEnd());
+}
+
 // ============================================================================
 std::shared_ptr<IMP3> IMP3::create(const unsigned char* f_data, size_t f_size)
 {
@@ -375,5 +1118,10 @@ std::shared_ptr<IMP3> IMP3::create(const std::string& f_path)
 	return CMP3::create(f_path);
 }
 
+std::shared_ptr<IMP3> IMP3::create(const std::string& f_path, size_t f_windowSize)
+{
+	return CMP3::create(f_path, f_windowSize);
+}
+
 IMP3::~IMP3() {}
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <memory> // shared_ptr
+#include <vector>
+#include <cstdint>
 
 
 namespace MPEG
@@ -21,6 +23,10 @@ class IMP3
 public:
 	static std::shared_ptr<IMP3> create(const unsigned char* f_data, size_t f_size);
 	static std::shared_ptr<IMP3> create(const std::string& f_path);
+	// Walk the file through a sliding mapped window of the given size (64 KiB at least): memory use
+	// doesn't depend on the file size, except for tags which are mapped whole. The MPEG stream and
+	// garbage around it aren't loaded (mpegStream() is empty). Free format streams aren't supported.
+	static std::shared_ptr<IMP3> create(const std::string& f_path, size_t f_windowSize);
 
 	virtual std::shared_ptr<MPEG::IStream>	mpegStream		() const = 0;
 	virtual std::shared_ptr<Tag::IID3v1>	tagID3v1		() const = 0;
@@ -30,11 +36,26 @@ public:
 
 	virtual bool							hasIssues		() const = 0;
 
-	virtual unsigned						mpegStreamOffset() const = 0;
-	virtual unsigned						tagID3v1Offset	() const = 0;
-	virtual unsigned						tagID3v2Offset	() const = 0;
-	virtual unsigned						tagAPEOffset	() const = 0;
-	virtual unsigned						tagLyricsOffset	() const = 0;
+	virtual uint64_t						mpegStreamOffset() const = 0;
+	virtual uint64_t						mpegStreamSize	() const = 0;
+	virtual uint64_t						tagID3v1Offset	() const = 0;
+	virtual uint64_t						tagID3v2Offset	() const = 0;
+	virtual uint64_t						tagAPEOffset	() const = 0;
+	virtual uint64_t						tagLyricsOffset	() const = 0;
+
+	// Byte range of damaged MPEG frames, the offset is relative to the file start
+	struct Range
+	{
+		uint64_t offset;
+		uint64_t size;
+	};
+	// Check frame sync, header consistency and CRC-16 (Layers I-III) of the MPEG stream using all cores.
+	// Everything from the stream start up to the trailing tags or the end of data is checked, so data
+	// after a broken frame is reported as well. The data must be the one the object was created from.
+	// Free format streams aren't supported.
+	virtual std::vector<Range>				verify			(const unsigned char* f_data, size_t f_size) const = 0;
+	// Same for an object created from a file, the file is walked through mapped windows
+	virtual std::vector<Range>				verify			() const = 0;
 
 	virtual bool							serialize		(const std::string& f_path) = 0;
 